@@ -1,6 +1,5 @@
 import pandas as pd
 import json
-from tqdm import tqdm
 import sys
 import os.path as osp
 import numpy as np
@@ -17,11 +16,7 @@ def aqp_online(data: pd.DataFrame, Q: list) -> list:
     
     workloads, arg = aqplib.standlize(workloads) # 数值化+排序
     
-    results = []
-    
-    for _, workload in tqdm(workloads.iterrows()):
-        ans = aqplib.query(workload)
-        results.append(ans)
+    results = aqplib.query_batch(workloads) # 一次调用，按模型分组并行查询
     
     arg = np.argsort(arg)
     results = [results[i] for i in arg]
@@ -30,12 +25,17 @@ def aqp_online(data: pd.DataFrame, Q: list) -> list:
     
     return results
 
-def aqp_offline(data: pd.DataFrame, Q: list) -> None: 
+def aqp_offline(data: pd.DataFrame, Q: list, memory_budget=aqplib.MEMORY_BUDGET) -> None: 
     '''无需返回任何值
     必须编写的aqp_offline函数，用data和Offline-workload，构建采样、索引、机器学习相关的结构或模型
     data是一个DataFrame，Q是一个包含多个json格式字符串的list
     如果你的算法无需构建结构或模型，该函数可以为空
+    memory_budget: 按工作负载挑选的模型文件总大小上限（字节）；Q 为空时构建全部模型
     '''
     aqplib.loadDataset(data)
-    aqplib.buildKDTrees(force=False) # 构造KD树
+    workloads = None
+    if len(Q) > 0:
+        workloads = pd.json_normalize([json.loads(i) for i in Q])
+        workloads, _ = aqplib.standlize(workloads)
+    aqplib.buildKDTrees(force=False, workloads=workloads, memoryBudget=memory_budget) # 按离线工作负载挑选并构造KD树
     aqplib.loadModels() # 加载到内存
\ No newline at end of file
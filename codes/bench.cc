@@ -0,0 +1,381 @@
+// Benchmark of the build and query hot paths on synthetic flight-shaped data.
+// Builds the models of each mode, times build() per model, load_models() and
+// aqpQuery per query shape, and writes the results as JSON to stdout. The
+// library's own log lines go to stderr.
+//
+//   ./bench --rows 1000000 --skew 1.1 --cards 20,300,50,300,50 --queries 500
+#include "libaqp.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+// YEAR_DATE, DEP_DELAY, TAXI_OUT, TAXI_IN, ARR_DELAY, AIR_TIME, DISTANCE,
+// then UNIQUE_CARRIER, ORIGIN, ORIGIN_STATE_ABR, DEST, DEST_STATE_ABR
+#define BENCH_COL_NUM 12
+#define BENCH_DIM 7
+
+struct BenchConfig {
+    int rows = 1000000;
+    double skew = 1.0;  // Zipf exponent of the discrete values, 0 for uniform
+    int cards[BENCH_COL_NUM - BENCH_DIM] = {20, 300, 50, 300, 50};
+    int queries = 200;  // per shape and mode
+    int threads = 0;
+    int node_format = FLAT_NODES;
+    uint64_t result_cache = 0;  // bytes, off so repeated queries are measured too
+    unsigned seed = 1;
+    std::string dir = "bench_models";
+    std::string modes = "memory,performance";
+};
+
+using Clock = std::chrono::steady_clock;
+
+static double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// draws a value in [0, n) with probability proportional to 1 / (v + 1)^skew
+struct Zipf {
+    std::vector<double> cdf;
+
+    Zipf(int n, double skew) : cdf(n) {
+        double sum = 0;
+        for (int v = 0; v < n; v++) {
+            sum += 1 / std::pow(v + 1, skew);
+            cdf[v] = sum;
+        }
+        for (double& p : cdf) {
+            p /= sum;
+        }
+    }
+
+    int operator()(std::mt19937_64& rng) const {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        return std::min<int>(std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin(), cdf.size() - 1);
+    }
+};
+
+// row-major rows of the flight table: delays are heavy tailed, ARR_DELAY
+// follows DEP_DELAY and AIR_TIME follows DISTANCE
+static std::vector<FLOAT_T> generate(const BenchConfig& config) {
+    std::mt19937_64 rng(config.seed);
+    std::vector<Zipf> zipfs;
+    for (int card : config.cards) {
+        zipfs.emplace_back(card, config.skew);
+    }
+    std::uniform_real_distribution<double> uniform(0, 1);
+    std::exponential_distribution<double> delay(1 / 15.0);
+    std::normal_distribution<double> noise(0, 1);
+    std::vector<FLOAT_T> data((size_t)config.rows * BENCH_COL_NUM);
+    for (int i = 0; i < config.rows; i++) {
+        FLOAT_T* row = &data[(size_t)i * BENCH_COL_NUM];
+        double distance = 100 + 2900 * std::pow(uniform(rng), 2);
+        double dep_delay = delay(rng) - 10;
+        row[0] = std::floor(uniform(rng) * 365 * 20);
+        row[1] = std::round(dep_delay);
+        row[2] = std::round(std::max(1.0, 15 + 6 * noise(rng)));
+        row[3] = std::round(std::max(1.0, 7 + 3 * noise(rng)));
+        row[4] = std::round(dep_delay + 8 * noise(rng) - 5);
+        row[5] = std::round(std::max(20.0, distance / 8 + 10 * noise(rng)));
+        row[6] = std::round(distance);
+        for (int c = BENCH_DIM; c < BENCH_COL_NUM; c++) {
+            row[c] = zipfs[c - BENCH_DIM](rng);
+        }
+    }
+    return data;
+}
+
+// the models kdtree_aqp.buildKDTrees builds in memory mode
+static std::vector<std::vector<int>> memory_models() {
+    std::vector<std::vector<int>> models;
+    for (int mask = 0; mask < 1 << (BENCH_COL_NUM - BENCH_DIM); mask++) {
+        std::vector<int> model;
+        int discrete_num = __builtin_popcount(mask);
+        if (discrete_num > 3) {
+            continue;
+        }
+        if (discrete_num < 3) {
+            for (int c = 0; c < BENCH_DIM; c++) {
+                model.push_back(c);
+            }
+        }
+        for (int c = BENCH_DIM; c < BENCH_COL_NUM; c++) {
+            if (mask >> (c - BENCH_DIM) & 1) {
+                model.push_back(c);
+            }
+        }
+        models.push_back(model);
+    }
+    return models;
+}
+
+struct Query {
+    std::vector<Predication> preds;
+    COL_T groupBy_col = -1;
+};
+
+// A query shape and how to draw one from a row of the data
+struct Shape {
+    const char* name;
+    std::vector<int> model;  // columns of its model in performance mode
+    Query (*make)(const FLOAT_T* row, std::mt19937_64& rng);
+};
+
+static Predication range_around(const FLOAT_T* row, int c, double width, std::mt19937_64& rng) {
+    double w = width * std::uniform_real_distribution<double>(0.5, 1.5)(rng);
+    return {c, FLOAT_T(row[c] - w), FLOAT_T(row[c] + w)};
+}
+
+static const Shape SHAPES[] = {
+    // WHERE UNIQUE_CARRIER = ? AND ORIGIN = ?
+    {"point", {7, 8}, [](const FLOAT_T* row, std::mt19937_64&) {
+         Query q;
+         q.preds = {{7, row[7], row[7]}, {8, row[8], row[8]}};
+         return q;
+     }},
+    // WHERE DEP_DELAY BETWEEN ? AND ? AND DISTANCE BETWEEN ? AND ?
+    {"range", {1, 6}, [](const FLOAT_T* row, std::mt19937_64& rng) {
+         Query q;
+         q.preds = {range_around(row, 1, 20, rng), range_around(row, 6, 300, rng)};
+         return q;
+     }},
+    // WHERE YEAR_DATE BETWEEN ? AND ? GROUP BY UNIQUE_CARRIER
+    {"group_by", {0, 7}, [](const FLOAT_T* row, std::mt19937_64& rng) {
+         Query q;
+         q.preds = {range_around(row, 0, 365, rng)};
+         q.groupBy_col = 7;
+         return q;
+     }},
+    // WHERE ARR_DELAY BETWEEN ? AND ? AND DEST = ? GROUP BY UNIQUE_CARRIER
+    {"range_group_by", {4, 7, 10}, [](const FLOAT_T* row, std::mt19937_64& rng) {
+         Query q;
+         q.preds = {range_around(row, 4, 30, rng), {10, row[10], row[10]}};
+         q.groupBy_col = 7;
+         return q;
+     }},
+};
+
+struct Latency {
+    double p50, p99, mean, max;
+};
+
+static Latency summarize(std::vector<double>& us) {
+    std::sort(us.begin(), us.end());
+    Latency l = {0, 0, 0, 0};
+    if (us.empty()) {
+        return l;
+    }
+    l.p50 = us[us.size() / 2];
+    l.p99 = us[std::min(us.size() - 1, us.size() * 99 / 100)];
+    l.max = us.back();
+    for (double t : us) {
+        l.mean += t;
+    }
+    l.mean /= us.size();
+    return l;
+}
+
+static size_t file_bytes(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+static std::string model_name(const std::vector<int>& model) {
+    std::vector<int> cols = model;
+    std::sort(cols.begin(), cols.end());
+    std::string name;
+    for (int c : cols) {
+        name += (name.empty() ? "" : "_") + std::to_string(c);
+    }
+    return name;
+}
+
+static void remove_models(const BenchConfig& config) {
+    std::string list = config.dir + "/model_list.txt";
+    FILE* file = fopen(list.c_str(), "r");
+    if (file != nullptr) {
+        char name[100];
+        while (fscanf(file, "%99s", name) == 1) {
+            unlink((config.dir + "/model_" + name + ".bin").c_str());
+        }
+        fclose(file);
+    }
+    unlink(list.c_str());
+}
+
+// build, load and query one mode, appending its JSON object to out
+static void run_mode(const BenchConfig& config, MODE mode, std::vector<FLOAT_T>& data, FILE* out) {
+    const char* mode_name = mode == MEMORY ? "memory" : "performance";
+    std::vector<std::vector<int>> models;
+    if (mode == MEMORY) {
+        models = memory_models();
+    } else {
+        for (const Shape& shape : SHAPES) {
+            models.push_back(shape.model);
+        }
+    }
+    int delta_depth = mode == MEMORY ? 1 : -3;
+    float build_k = mode == MEMORY ? 1 : 0.1;
+
+    clear();
+    remove_models(config);
+    loadData(data.data(), config.rows);
+    setNodeFormat((NODE_FORMAT)config.node_format);
+    fprintf(out, "    {\n      \"mode\": \"%s\",\n      \"delta_depth\": %d,\n      \"build\": [\n", mode_name, delta_depth);
+    double build_total = 0;
+    size_t bytes_total = 0;
+    for (size_t m = 0; m < models.size(); m++) {
+        Clock::time_point start = Clock::now();
+        build(models[m].data(), models[m].size(), delta_depth, build_k, config.threads);
+        double seconds = seconds_since(start);
+        std::string name = model_name(models[m]);
+        size_t bytes = file_bytes(config.dir + "/model_" + name + ".bin");
+        build_total += seconds;
+        bytes_total += bytes;
+        fprintf(out, "        {\"model\": \"%s\", \"seconds\": %.6f, \"bytes\": %zu}%s\n", name.c_str(), seconds, bytes,
+                m + 1 < models.size() ? "," : "");
+    }
+    fprintf(out, "      ],\n      \"build_seconds\": %.6f,\n      \"model_bytes\": %zu,\n", build_total, bytes_total);
+
+    resetCacheStats();
+    Clock::time_point start = Clock::now();
+    load_models();
+    double load_seconds = seconds_since(start);
+    CacheStats stats;
+    getCacheStats(&stats);
+    fprintf(out, "      \"load_seconds\": %.6f,\n      \"resident_bytes\": %llu,\n      \"queries\": [\n", load_seconds,
+            (unsigned long long)stats.resident_bytes);
+
+    Operation ops[] = {{COUNT, -1}, {SUM, 4}, {AVG, 4}};
+    int shape_num = sizeof(SHAPES) / sizeof(SHAPES[0]);
+    for (int s = 0; s < shape_num; s++) {
+        // the same queries in both modes
+        std::mt19937_64 rng(config.seed * 7919 + s);
+        std::vector<double> us;
+        resetQueryStats();
+        for (int i = 0; i < config.queries; i++) {
+            const FLOAT_T* row = &data[(size_t)(rng() % config.rows) * BENCH_COL_NUM];
+            Query q = SHAPES[s].make(row, rng);
+            Clock::time_point query_start = Clock::now();
+            Answer* ans = aqpQuery(ops, 3, q.preds.data(), q.preds.size(), q.groupBy_col, mode);
+            us.push_back(seconds_since(query_start) * 1e6);
+            freeAnswer(ans);
+        }
+        Latency l = summarize(us);
+        fprintf(out,
+                "        {\"shape\": \"%s\", \"count\": %d, \"p50_us\": %.3f, \"p99_us\": %.3f, \"mean_us\": %.3f, "
+                "\"max_us\": %.3f",
+                SHAPES[s].name, config.queries, l.p50, l.p99, l.mean, l.max);
+#ifdef AQP_STATS
+        // work per query, see QueryStats
+        QueryStats stats;
+        getQueryStats(&stats);
+        double n = std::max<uint64_t>(stats.queries, 1);
+        fprintf(out,
+                ", \"nodes_visited\": %.1f, \"nodes_contained\": %.1f, \"partial_leaves\": %.1f, "
+                "\"groups_probed\": %.1f, \"cache_misses\": %llu, \"result_hits\": %llu, \"load_us\": %.3f",
+                stats.nodes_visited / n, stats.nodes_contained / n, stats.partial_leaves / n, stats.groups_probed / n,
+                (unsigned long long)stats.cache_misses, (unsigned long long)stats.result_hits, stats.load_ns / 1e3);
+#endif
+        fprintf(out, "}%s\n", s + 1 < shape_num ? "," : "");
+    }
+    fprintf(out, "      ]\n    }");
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [--rows N] [--skew S] [--cards A,B,C,D,E] [--queries N] [--threads N]\n"
+            "          [--node-format 0|1|2] [--result-cache BYTES] [--seed N] [--dir PATH]\n"
+            "          [--modes memory,performance]\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    BenchConfig config;
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+        }
+        const char* arg = argv[i];
+        const char* value = argv[++i];
+        if (!strcmp(arg, "--rows")) {
+            config.rows = atoi(value);
+        } else if (!strcmp(arg, "--skew")) {
+            config.skew = atof(value);
+        } else if (!strcmp(arg, "--cards")) {
+            int n = sscanf(value, "%d,%d,%d,%d,%d", &config.cards[0], &config.cards[1], &config.cards[2],
+                           &config.cards[3], &config.cards[4]);
+            if (n != BENCH_COL_NUM - BENCH_DIM) {
+                usage(argv[0]);
+            }
+        } else if (!strcmp(arg, "--queries")) {
+            config.queries = atoi(value);
+        } else if (!strcmp(arg, "--threads")) {
+            config.threads = atoi(value);
+        } else if (!strcmp(arg, "--node-format")) {
+            config.node_format = atoi(value);
+        } else if (!strcmp(arg, "--result-cache")) {
+            config.result_cache = strtoull(value, nullptr, 10);
+        } else if (!strcmp(arg, "--seed")) {
+            config.seed = atoi(value);
+        } else if (!strcmp(arg, "--dir")) {
+            config.dir = value;
+        } else if (!strcmp(arg, "--modes")) {
+            config.modes = value;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (config.rows <= 0 || config.queries <= 0) {
+        usage(argv[0]);
+    }
+
+    // keep stdout for the JSON, the library logs with printf
+    FILE* out = fdopen(dup(1), "w");
+    dup2(2, 1);
+
+    mkdir(config.dir.c_str(), 0755);
+    init(config.dir.c_str());
+    int value_num[BENCH_COL_NUM] = {0};
+    for (int c = BENCH_DIM; c < BENCH_COL_NUM; c++) {
+        value_num[c] = config.cards[c - BENCH_DIM];
+    }
+    setSchema(BENCH_COL_NUM, value_num);
+    setResultCacheSize(config.result_cache);
+
+    Clock::time_point start = Clock::now();
+    std::vector<FLOAT_T> data = generate(config);
+    double generate_seconds = seconds_since(start);
+
+    fprintf(out, "{\n  \"config\": {\"rows\": %d, \"skew\": %g, \"cards\": [%d, %d, %d, %d, %d], \"queries\": %d, ",
+            config.rows, config.skew, config.cards[0], config.cards[1], config.cards[2], config.cards[3],
+            config.cards[4], config.queries);
+    fprintf(out, "\"threads\": %d, \"node_format\": %d, \"result_cache\": %llu, \"seed\": %u},\n", config.threads,
+            config.node_format, (unsigned long long)config.result_cache, config.seed);
+    fprintf(out, "  \"generate_seconds\": %.6f,\n  \"modes\": [\n", generate_seconds);
+    bool first = true;
+    for (MODE mode : {MEMORY, PERFORMANCE}) {
+        if (config.modes.find(mode == MEMORY ? "memory" : "performance") == std::string::npos) {
+            continue;
+        }
+        if (!first) {
+            fprintf(out, ",\n");
+        }
+        first = false;
+        run_mode(config, mode, data, out);
+        fflush(out);
+    }
+    fprintf(out, "\n  ]\n}\n");
+    fclose(out);
+    clear();
+    return 0;
+}
@@ -7,7 +7,7 @@ KD树近似查询库
 4. 使用 query 函数进行查询
 """
 import ctypes
-from ctypes import CDLL, POINTER, Structure, c_int, c_float, c_double
+from ctypes import CDLL, POINTER, Structure, c_int, c_float, c_double, c_uint32, c_uint64
 import numpy as np
 import pandas as pd
 import os.path as osp
@@ -15,15 +15,16 @@ import os
 from timeit import default_timer as timer
 import atexit
 from itertools import combinations, product
-from tqdm import tqdm
-from scipy.special import comb
 import shutil
+import struct
 
 WORKING_DIR = osp.dirname(osp.dirname(osp.abspath(__file__)))
 # WORKING_DIR = '*/2021201626/'
 HANDOUTS_DIR = osp.dirname(WORKING_DIR)
 DATA_DIR = osp.join(WORKING_DIR, "tmp")  # 存放临时数据的目录，很重要，要保证至少有1GB的空间（10GB以上为佳）
 MODEL_DIR = osp.join(DATA_DIR, "models")
+DATASET_FILE = osp.join(DATA_DIR, "dataset.bin")  # libaqp 直接 mmap 的列式数据
+MEMORY_BUDGET = 4 << 30  # adviseModels 挑选的模型文件总大小上限（字节）
 
 shutil.rmtree(DATA_DIR, ignore_errors=True)
 os.mkdir(DATA_DIR)
@@ -74,7 +75,7 @@ COLUMN2INDEX.update({"*": -1})
 COLUMN2INDEX.update({"_None_": -1})
 INDEX2COLUMN = COLUMNS
 
-DATASET, VALUE2ID, ID2VALUE = None, None, None
+VALUE2ID, ID2VALUE = None, None
 
 global_mode = "memory"  # 'memory' or 'performance'
 
@@ -136,9 +137,9 @@ def factorize(df, columns=DISCRETE_COLUMNS):
 
 
 def get_modelName(predicate, groupBy) -> str:
-    col = [int(p[0]) for p in predicate]
-    if groupBy not in col and groupBy != -1:
-        col.append(groupBy)
+    col = {int(p[0]) for p in predicate}
+    if groupBy != -1:
+        col.add(groupBy)
     col = sorted(col)
     modelName = "_".join([str(c) for c in col])
     return modelName
@@ -150,7 +151,7 @@ def standlize(workloads: pd.DataFrame):
     """
 
     # result_col
-    op_map = {"count": 0, "sum": 1, "avg": 2}
+    op_map = {"count": 0, "sum": 1, "avg": 2, "min": 3, "max": 4, "var": 5, "stddev": 6}
     standlized_result_col = []
     for result_col in workloads["result_col"]:
         standlized_result_col.append(
@@ -159,23 +160,26 @@ def standlize(workloads: pd.DataFrame):
     workloads["result_col"] = standlized_result_col
 
     # predicate
+    # 同一列的多个谓词取并集：离散列的 "values" 是 IN 列表，连续列的 "values" 是 [lb, ub] 区间列表
     standlized_predicate = []
     for predicate in workloads["predicate"]:
         predicate_tmp = []
         for i in predicate:
             col = COLUMN2INDEX[i["col"]]
-            if i["col"] in DISCRETE_COLUMNS:
-                lb = ub = VALUE2ID[i["col"]][i["lb"]]
-            else:
-                if i["lb"] == "_None_":
-                    lb = 0
+            for value in i.get("values", [(i["lb"], i["ub"])]):
+                if i["col"] in DISCRETE_COLUMNS:
+                    lb = ub = VALUE2ID[i["col"]][value if "values" in i else i["lb"]]
                 else:
-                    lb = float(i["lb"])
-                if i["ub"] == "_None_":
-                    ub = 1e9
-                else:
-                    ub = float(i["ub"])
-            predicate_tmp.append((col, lb, ub))
+                    lb, ub = value
+                    if lb == "_None_":
+                        lb = 0
+                    else:
+                        lb = float(lb)
+                    if ub == "_None_":
+                        ub = 1e9
+                    else:
+                        ub = float(ub)
+                predicate_tmp.append((col, lb, ub))
         standlized_predicate.append(predicate_tmp)
     workloads["predicate"] = standlized_predicate
 
@@ -195,25 +199,57 @@ def standlize(workloads: pd.DataFrame):
     return workloads, arg
 
 
+DATASET_MAGIC = 0x4454444B  # 与 libaqp.h 中的 DatasetHeader 对应
+DATASET_VERSION = 1
+FLOAT_COLUMN, CODE_COLUMN = 0, 1
+
+
+def saveDatasetFile(dataset, id2value, path=DATASET_FILE):
+    """
+    写出列式二进制数据集：连续列为 float32，离散列为 int32 编码，并附带字典。
+    """
+    header_size = 24 + 32 * len(COLUMNS)
+    offset = header_size
+    entries, blobs = [], []
+    for col in COLUMNS:
+        offset = (offset + 63) // 64 * 64
+        if col in DISCRETE_COLUMNS:
+            values = dataset[col].values.astype(np.int32)
+            names = id2value[col]
+            dictionary = b"".join(str(v).encode("utf-8") + b"\0" for v in names)
+            entry = (CODE_COLUMN, len(names), offset, offset + values.nbytes, len(dictionary))
+        else:
+            values = dataset[col].values.astype(np.float32)
+            dictionary = b""
+            entry = (FLOAT_COLUMN, 0, offset, 0, 0)
+        entries.append(entry)
+        blobs.append((offset, values.tobytes() + dictionary))
+        offset += values.nbytes + len(dictionary)
+    with open(path, "wb") as f:
+        f.write(struct.pack("<IIIIQ", DATASET_MAGIC, DATASET_VERSION, len(COLUMNS), 0, len(dataset)))
+        for entry in entries:
+            f.write(struct.pack("<IIQQQ", *entry))
+        for offset, blob in blobs:
+            f.seek(offset)
+            f.write(blob)
+
+
 def _get_valueMaps_from_dataset(dataset):
     dataset, id2value, value2id = factorize(dataset)
     maps = [value2id, id2value]
     np.save(osp.join(DATA_DIR, "valueMaps.npy"), maps)
-    dataset.to_csv(osp.join(DATA_DIR, "factorizedDataset.csv"), index=False)
-    return dataset, value2id, id2value
+    saveDatasetFile(dataset, id2value)
+    return value2id, id2value
 
 
 def map_factorized_init(dataset=None):
-    global DATASET, VALUE2ID, ID2VALUE
-    if osp.exists(osp.join(DATA_DIR, "valueMaps.npy")) and osp.exists(
-        osp.join(DATA_DIR, "factorizedDataset.csv")
-    ):
-        DATASET = pd.read_csv(osp.join(DATA_DIR, "factorizedDataset.csv"))
+    global VALUE2ID, ID2VALUE
+    if osp.exists(osp.join(DATA_DIR, "valueMaps.npy")) and osp.exists(DATASET_FILE):
         VALUE2ID, ID2VALUE = np.load(
             osp.join(DATA_DIR, "valueMaps.npy"), allow_pickle=True
         )
     elif dataset is not None:
-        DATASET, VALUE2ID, ID2VALUE = _get_valueMaps_from_dataset(dataset)
+        VALUE2ID, ID2VALUE = _get_valueMaps_from_dataset(dataset)
 
 
 lib = CDLL(osp.join(CODE_DIR, "libaqp.so"))
@@ -231,25 +267,135 @@ class GroupAnswer(Structure):
     _fields_ = [("id", c_int), ("value", c_float)]
 
 
+class AnswerBound(Structure):
+    _fields_ = [("lo", c_float), ("hi", c_float)]
+
+
+class QueryStats(Structure):
+    _fields_ = [
+        ("queries", c_uint64),
+        ("nodes_visited", c_uint64),
+        ("nodes_contained", c_uint64),
+        ("partial_leaves", c_uint64),
+        ("groups_probed", c_uint64),
+        ("cache_hits", c_uint64),
+        ("cache_misses", c_uint64),
+        ("result_hits", c_uint64),
+        ("load_ns", c_uint64),
+        ("load_bytes", c_uint64),
+        ("query_ns", c_uint64),
+    ]
+
+
 class Answer(Structure):
-    _fields_ = [("group_ans", POINTER(GroupAnswer)), ("size", c_int)]
+    _fields_ = [
+        ("group_ans", POINTER(GroupAnswer)),
+        ("size", c_int),
+        ("stopped_early", c_int),
+        ("error", c_int),  # QUERY_ERROR，非 0 时没有结果
+        ("bounds", POINTER(AnswerBound)),
+        ("stats", POINTER(QueryStats)),  # 仅在 make STATS=1 编译时非空
+    ]
 
 
 class AnswerBatch(Structure):
     _fields_ = [("ans", POINTER(Answer)), ("size", c_int)]
 
 
+class WorkloadEntry(Structure):
+    _fields_ = [("pred_cols", c_uint32), ("groupBy_col", c_int), ("frequency", c_double)]
+
+
+class ModelAdvice(Structure):
+    _fields_ = [
+        ("model_key", c_uint32),
+        ("delta_depth", c_int),
+        ("bytes", c_uint64),
+        ("frequency", c_double),
+        ("nodes", c_double),
+        ("partial", c_double),
+    ]
+
+
+class CacheStats(Structure):
+    _fields_ = [
+        ("hits", c_uint64),
+        ("misses", c_uint64),
+        ("prefetches", c_uint64),
+        ("evictions", c_uint64),
+        ("loaded_bytes", c_uint64),
+        ("evicted_bytes", c_uint64),
+        ("resident_bytes", c_uint64),
+        ("memory_limit", c_uint64),
+        ("resident_models", c_int),
+        ("pinned_models", c_int),
+    ]
+
+
 def loadDataset(dataset):
-    if not osp.exists(osp.join(DATA_DIR, "factorizedDataset.csv")):
+    if not osp.exists(DATASET_FILE):
         dataset = dataset[COLUMNS]
         map_factorized_init(dataset)
-        dataset = DATASET.copy()
-        values = dataset.values.astype(np.float32)
-        values = values.flatten()
-        lib.loadData(values.ctypes.data_as(POINTER(c_float)), dataset.shape[0])
-
-
-def buildKDTrees(force=True, deltaDepth=None, buildK=None):
+    setSchema()
+    lib.loadDataFile(DATASET_FILE.encode("utf-8"))
+
+
+def setSchema():
+    """把列的类型和离散列的取值个数告诉 libaqp，与模型一起保存在 MODEL_DIR"""
+    value_num = [len(ID2VALUE[col]) if col in DISCRETE_COLUMNS else 0 for col in COLUMNS]
+    os.makedirs(MODEL_DIR, exist_ok=True)
+    lib.setSchema(len(COLUMNS), (c_int * len(COLUMNS))(*value_num))
+
+
+def appendDataset(rows, threadNum=0):
+    """追加新数据并增量更新已构建的模型，离散值须已出现在 VALUE2ID 中"""
+    rows = rows[COLUMNS].copy()
+    known = np.ones(len(rows), dtype=bool)
+    for col in DISCRETE_COLUMNS:
+        ids = rows[col].map(VALUE2ID[col])
+        known &= ids.notna().values
+        rows[col] = ids
+    rows = rows[known]
+    values = rows.values.astype(np.float32).flatten()
+    lib.appendData(values.ctypes.data_as(POINTER(c_float)), rows.shape[0], threadNum)
+
+
+def adviseModels(workloads: pd.DataFrame, memoryBudget=MEMORY_BUDGET):
+    """按 standlize 后的工作负载挑选要构建的模型及各自的 delta_depth
+    返回 ModelAdvice 数组，按查询频率从高到低"""
+    shapes = {}
+    for predicate, groupBy_col in zip(workloads["predicate"], workloads["groupby"]):
+        pred_cols = sum({1 << int(p[0]) for p in predicate})
+        shapes[(pred_cols, groupBy_col)] = shapes.get((pred_cols, groupBy_col), 0) + 1
+    entries = (WorkloadEntry * len(shapes))(
+        *[WorkloadEntry(pred_cols, groupBy_col, freq) for (pred_cols, groupBy_col), freq in shapes.items()]
+    )
+    advice = (ModelAdvice * len(shapes))()
+    advice_num = lib.adviseModels(entries, len(shapes), _get_mode(), memoryBudget, advice, len(shapes))
+    return advice[:advice_num]
+
+
+def _print_dropped_shapes(workloads: pd.DataFrame, advice, memoryBudget):
+    """打印没有任何挑选的模型能覆盖的查询形状"""
+    dropped = set()
+    for predicate, groupBy_col in zip(workloads["predicate"], workloads["groupby"]):
+        need = sum({1 << int(p[0]) for p in predicate})
+        if groupBy_col != -1:
+            need |= 1 << int(groupBy_col)
+        if not any(need & ~a.model_key == 0 for a in advice):
+            dropped.add((tuple(sorted({INDEX2COLUMN[int(p[0])] for p in predicate})), groupBy_col))
+    for pred_cols, groupBy_col in sorted(dropped, key=str):
+        groupBy = INDEX2COLUMN[int(groupBy_col)] if groupBy_col != -1 else None
+        print(f"buildKDTrees: no model within {memoryBudget} bytes for predicates {list(pred_cols)} group by {groupBy}")
+
+
+def buildKDTrees(force=True, deltaDepth=None, buildK=None, threadNum=0, nodeFormat=0, workloads=None,
+                 leafSynopses=False, memoryBudget=MEMORY_BUDGET):
+    """threadNum <= 0 使用所有核心
+    nodeFormat: 0 原始节点, 1 量化节点 + float 求和, 2 量化节点 + double 求和
+    leafSynopses: 原始节点的每个叶子保存各维的分布, 部分覆盖的叶子按分布而非均匀假设估计
+    workloads: standlize 后的离线工作负载, 非空时只构建 adviseModels 在 memoryBudget 字节内挑选的模型,
+    放不下的查询形状会打印出来; 为 None 或为空时构建全部模型"""
     if not osp.exists(MODEL_DIR):
         os.mkdir(MODEL_DIR)
     mode = global_mode
@@ -258,51 +404,70 @@ def buildKDTrees(force=True, deltaDepth=None, buildK=None):
     print(mode, deltaDepth, buildK)
     if osp.exists(osp.join(MODEL_DIR, "model_list.txt")):
         os.remove(osp.join(MODEL_DIR, "model_list.txt"))
+    lib.setNodeFormat(nodeFormat)
+    lib.setLeafSynopses(int(leafSynopses))
+    if workloads is not None and len(workloads) > 0:
+        if buildK is None:
+            buildK = 0.1 if mode == "performance" else 1
+        advice = adviseModels(workloads, memoryBudget)
+        _print_dropped_shapes(workloads, advice, memoryBudget)
+        lib.buildAdvisedModels((ModelAdvice * len(advice))(*advice), len(advice), buildK, threadNum)
+        return
+    models = []
     if mode == "performance":
         if deltaDepth is None:
             deltaDepth = -3
         if buildK is None:
             buildK = 0.1
         for pred_num in [1, 2, 3]:
-            for col in tqdm(
-                combinations(range(0, 12), pred_num), total=int(comb(12, pred_num))
-            ):
-                col_np = np.array(col, dtype=np.int32)
-                lib.build(
-                    col_np.ctypes.data_as(POINTER(c_int)),
-                    len(col_np),
-                    deltaDepth,
-                    buildK,
-                )
+            for col in combinations(range(len(COLUMNS)), pred_num):
+                models.append(list(col))
     else:  # mode == 'memory'
         if deltaDepth is None:
             deltaDepth = 1
         if buildK is None:
             buildK = 1
+        continuous = [COLUMN2INDEX[c] for c in CONTINUOUS_COLUMNS]
+        discrete = [COLUMN2INDEX[c] for c in DISCRETE_COLUMNS]
         for di_pred_num in [0, 1, 2, 3]:
-            for di_col in tqdm(
-                combinations(range(7, 12), di_pred_num), total=int(comb(5, di_pred_num))
-            ):
+            for di_col in combinations(discrete, di_pred_num):
                 if di_pred_num < 3:
-                    col_np = np.r_[
-                        np.array(range(7), dtype=np.int32),
-                        np.array(di_col, dtype=np.int32),
-                    ]
+                    models.append(continuous + list(di_col))
                 else:
-                    col_np = np.array(di_col, dtype=np.int32)
-                lib.build(
-                    col_np.ctypes.data_as(POINTER(c_int)),
-                    len(col_np),
-                    deltaDepth,
-                    buildK,
-                )
+                    models.append(list(di_col))
+    cols_np = np.array([c for model in models for c in model], dtype=np.int32)
+    sizes_np = np.array([len(model) for model in models], dtype=np.int32)
+    lib.buildModels(
+        cols_np.ctypes.data_as(POINTER(c_int)),
+        sizes_np.ctypes.data_as(POINTER(c_int)),
+        len(models),
+        deltaDepth,
+        buildK,
+        threadNum,
+    )
 
 
-def query(workload):
+def _get_mode():
     if global_mode == "performance":
-        mode = 0
+        return 0
     else:  # mode == 'memory'
-        mode = 1
+        return 1
+
+
+def _answer_to_list(ans, groupBy_col):
+    ret = []
+    for i in range(ans.size):
+        g_ans = ans.group_ans[i]
+        if g_ans.id < 0:
+            ret.append([g_ans.value])
+        else:
+            id = g_ans.id
+            ret.append([ID2VALUE[groupBy_col][id], g_ans.value])
+    return ret
+
+
+def query(workload):
+    mode = _get_mode()
 
     ops = np.array(workload["result_col"], dtype=Operation)
     preds = np.array(workload["predicate"], dtype=Predication)
@@ -316,19 +481,68 @@ def query(workload):
         groupBy_col,
         mode,
     )
-    ans = ans.contents
-    size = ans.size
-    ret = []
-    for i in range(size):
-        g_ans = ans.group_ans[i]
-        if g_ans.id < 0:
-            ret.append([g_ans.value])
-        else:
-            id = g_ans.id
-            ret.append([ID2VALUE[groupBy_col][id], g_ans.value])
+    ret = _answer_to_list(ans.contents, groupBy_col)
+    lib.freeAnswer(ans)
     return ret
 
 
+def query_progressive(workload, timeBudgetMs=0, errorTarget=0):
+    """渐进式查询, 返回 (结果, 每个值的 95% 置信区间, 是否因超时提前停止)
+    timeBudgetMs / errorTarget <= 0 表示不限制"""
+    mode = _get_mode()
+
+    ops = np.array(workload["result_col"], dtype=Operation)
+    preds = np.array(workload["predicate"], dtype=Predication)
+    groupBy_col = workload["groupby"]
+    ans = lib.aqpQueryProgressive(
+        ops.ctypes.data_as(POINTER(Operation)),
+        len(ops),
+        preds.ctypes.data_as(POINTER(Predication)),
+        len(preds),
+        groupBy_col,
+        mode,
+        timeBudgetMs,
+        errorTarget,
+    )
+    ret = _answer_to_list(ans.contents, groupBy_col)
+    bounds = [(ans.contents.bounds[i].lo, ans.contents.bounds[i].hi) for i in range(ans.contents.size)]
+    stopped = bool(ans.contents.stopped_early)
+    lib.freeAnswer(ans)
+    return ret, bounds, stopped
+
+
+def query_batch(workloads: pd.DataFrame, threadNum=0):
+    """一次调用回答所有查询，threadNum <= 0 使用所有核心"""
+    mode = _get_mode()
+
+    result_cols = list(workloads["result_col"])
+    predicates = list(workloads["predicate"])
+    groupBy_cols = list(workloads["groupby"])
+
+    ops = np.array([op for ops in result_cols for op in ops], dtype=Operation)
+    preds = np.array([p for preds in predicates for p in preds], dtype=Predication)
+    op_offsets = np.cumsum([0] + [len(i) for i in result_cols]).astype(np.int32)
+    pred_offsets = np.cumsum([0] + [len(i) for i in predicates]).astype(np.int32)
+    groupBy_np = np.array(groupBy_cols, dtype=np.int32)
+
+    batch = lib.aqpQueryBatch(
+        ops.ctypes.data_as(POINTER(Operation)),
+        op_offsets.ctypes.data_as(POINTER(c_int)),
+        preds.ctypes.data_as(POINTER(Predication)),
+        pred_offsets.ctypes.data_as(POINTER(c_int)),
+        groupBy_np.ctypes.data_as(POINTER(c_int)),
+        len(groupBy_cols),
+        mode,
+        threadNum,
+    )
+    results = [
+        _answer_to_list(batch.contents.ans[i], groupBy_col)
+        for i, groupBy_col in enumerate(groupBy_cols)
+    ]
+    lib.freeAnswerBatch(batch)
+    return results
+
+
 @atexit.register
 def clear():
     lib.clear()
@@ -347,15 +561,113 @@ def lib_init():
     ]
     lib.aqpQuery.restype = POINTER(Answer)
 
+    lib.aqpQueryProgressive.argtypes = [
+        POINTER(Operation),
+        c_int,
+        POINTER(Predication),
+        c_int,
+        c_int,
+        c_int,
+        c_double,
+        c_double,
+    ]
+    lib.aqpQueryProgressive.restype = POINTER(Answer)
+
+    lib.freeAnswer.argtypes = [POINTER(Answer)]
+    lib.freeAnswer.restype = None
+
+    lib.aqpQueryBatch.argtypes = [
+        POINTER(Operation),
+        POINTER(c_int),
+        POINTER(Predication),
+        POINTER(c_int),
+        POINTER(c_int),
+        c_int,
+        c_int,
+        c_int,
+    ]
+    lib.aqpQueryBatch.restype = POINTER(AnswerBatch)
+
+    lib.freeAnswerBatch.argtypes = [POINTER(AnswerBatch)]
+    lib.freeAnswerBatch.restype = None
+
     lib.loadData.argtypes = [POINTER(c_float), c_int]
     lib.loadData.restype = None
 
+    lib.loadDataFile.argtypes = [ctypes.c_char_p]
+    lib.loadDataFile.restype = None
+
+    lib.appendData.argtypes = [POINTER(c_float), c_int, c_int]
+    lib.appendData.restype = None
+
     lib.clear.argtypes = []
     lib.clear.restype = None
 
-    lib.build.argtypes = [POINTER(c_int), c_int, c_int, c_float]
+    lib.build.argtypes = [POINTER(c_int), c_int, c_int, c_float, c_int]
     lib.build.restype = None
 
+    lib.buildModels.argtypes = [
+        POINTER(c_int),
+        POINTER(c_int),
+        c_int,
+        c_int,
+        c_float,
+        c_int,
+    ]
+    lib.buildModels.restype = None
+
+    lib.adviseModels.argtypes = [
+        POINTER(WorkloadEntry),
+        c_int,
+        c_int,
+        c_uint64,
+        POINTER(ModelAdvice),
+        c_int,
+    ]
+    lib.adviseModels.restype = c_int
+
+    lib.buildAdvisedModels.argtypes = [POINTER(ModelAdvice), c_int, c_float, c_int]
+    lib.buildAdvisedModels.restype = None
+
+    lib.setSchema.argtypes = [c_int, POINTER(c_int)]
+    lib.setSchema.restype = None
+
+    lib.setNodeFormat.argtypes = [c_int]
+    lib.setNodeFormat.restype = None
+
+    lib.setLeafSynopses.argtypes = [c_int]
+    lib.setLeafSynopses.restype = None
+
+    lib.setBuildMemory.argtypes = [c_uint64]
+    lib.setBuildMemory.restype = None
+
+    lib.prefetchModels.argtypes = [POINTER(c_uint32), c_int]
+    lib.prefetchModels.restype = None
+
+    lib.setMemoryLimit.argtypes = [c_uint64]
+    lib.setMemoryLimit.restype = None
+
+    lib.setResultCacheSize.argtypes = [c_uint64]
+    lib.setResultCacheSize.restype = None
+
+    lib.pinModel.argtypes = [ctypes.c_char_p]
+    lib.pinModel.restype = None
+
+    lib.unpinModel.argtypes = [ctypes.c_char_p]
+    lib.unpinModel.restype = None
+
+    lib.getCacheStats.argtypes = [POINTER(CacheStats)]
+    lib.getCacheStats.restype = None
+
+    lib.resetCacheStats.argtypes = []
+    lib.resetCacheStats.restype = None
+
+    lib.getQueryStats.argtypes = [POINTER(QueryStats)]
+    lib.getQueryStats.restype = None
+
+    lib.resetQueryStats.argtypes = []
+    lib.resetQueryStats.restype = None
+
     lib.init.argtypes = [ctypes.c_char_p]
     lib.init.restype = None
     dir = MODEL_DIR
@@ -368,4 +680,49 @@ def loadModels():
     lib.load_models()
 
 
+def prefetchModels(modelNames):
+    """在后台开始加载模型，模型名形如 "1_7_8"，不等待加载完成"""
+    keys = [sum(1 << int(col) for col in name.split("_")) for name in modelNames]
+    lib.prefetchModels((c_uint32 * len(keys))(*keys), len(keys))
+
+
+def setMemoryLimit(nbytes):
+    lib.setMemoryLimit(nbytes)
+
+
+def setBuildMemory(nbytes):
+    """同时构建的模型的字节上限，按数据量和树深估计，超出上限的模型单独构建"""
+    lib.setBuildMemory(nbytes)
+
+
+def setResultCacheSize(nbytes):
+    """结果缓存的字节上限, 0 关闭"""
+    lib.setResultCacheSize(nbytes)
+
+
+def pinModel(modelName):
+    lib.pinModel(modelName.encode("utf-8"))
+
+
+def unpinModel(modelName):
+    lib.unpinModel(modelName.encode("utf-8"))
+
+
+def cacheStats():
+    stats = CacheStats()
+    lib.getCacheStats(ctypes.byref(stats))
+    return {name: getattr(stats, name) for name, _ in CacheStats._fields_}
+
+
+def queryStats():
+    """所有查询的工作量统计，需用 make STATS=1 编译 libaqp.so，否则全为 0"""
+    stats = QueryStats()
+    lib.getQueryStats(ctypes.byref(stats))
+    return {name: getattr(stats, name) for name, _ in QueryStats._fields_}
+
+
+def resetQueryStats():
+    lib.resetQueryStats()
+
+
 lib_init()
@@ -1,32 +1,80 @@
 #pragma once
 #include <algorithm>
 #include <array>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <memory>
+#include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
-const int DATA_DIM = 7;
-const int COL_NUM = 12;
+// Largest schema the engine handles, see Schema. Continuous columns fill the
+// 8 floats of an AVX2 register, and a model key must index the cache's slots
+const int MAX_DATA_DIM = 8;
+const int LANES = MAX_DATA_DIM;
+const int MAX_COL_NUM = 16;
+// Predicates a query may have, see QueryContext
+const int MAX_QUERY_PREDS = 256;
 using COL_T = int;
 enum OP {
     COUNT,
     SUM,
     AVG,
+    MIN,     // exact over the nodes inside the query, bounded by the query on the others
+    MAX,
+    VAR,     // sample variance, from the sums of squares of the nodes
+    STDDEV,
 };
 using OP_T = OP;
 using INT_T = int;
 using FLOAT_T = float;
-// using DATA_T = FLOAT_T[DATA_DIM];
-using DATA_T = std::array<FLOAT_T, DATA_DIM>;
-using BOUND_T = float[DATA_DIM][2];
-using COL_VALUE_T = std::vector<std::pair<int, int>>;
+// using DATA_T = FLOAT_T[MAX_DATA_DIM];
+using DATA_T = std::array<FLOAT_T, MAX_DATA_DIM>;
+using BOUND_T = float[MAX_DATA_DIM][2];
+// bitmask of the columns of a model, the model's handle
+using MODEL_KEY_T = uint32_t;
 
 #define IS_LEAF(u) ((u)->lchild == nullptr && (u)->rchild == nullptr)
-#define IS_CONTINUED(c) ((c <= 6))
-#define IS_DISCRETE(c) ((c >= 7))
 #define GB (1024ull * 1024 * 1024)
+// Default byte budget of the model cache, see setMemoryLimit
 #define MEM_LIMIT (10 * GB)
+// Default byte budget of the models built at once, see setBuildMemory
+#define BUILD_MEMORY (4 * GB)
+// Default byte budget of the result cache, see setResultCacheSize
+#define RESULT_CACHE_BYTES (64ull << 20)
+
+// "KDTM" in little endian, the first 4 bytes of every model file
+#define MODEL_MAGIC 0x4d54444bu
+#define MODEL_VERSION 9u
+// Deepest tree a model may contain, bounds the traversal stack
+#define MAX_TREE_DEPTH 96
+#define KD_STACK_SIZE (MAX_TREE_DEPTH + 2)
+
+// Built with -DAQP_STATS (make STATS=1), queries count the work they do, see
+// QueryStats. Otherwise AQP_STAT compiles its statement out
+#ifdef AQP_STATS
+#define AQP_STAT(...) __VA_ARGS__
+#else
+#define AQP_STAT(...)
+#endif
+
+// "KDTD" in little endian, the first 4 bytes of a dataset file
+#define DATASET_MAGIC 0x4454444bu
+#define DATASET_VERSION 1u
+
+// Shape of the table: which columns are continuous, they become the
+// dimensions of the trees, and how many values each discrete column takes.
+// init reads it from schema.txt in the model directory, the flight table's
+// schema being the default
+struct Schema {
+    int col_num;
+    int data_dim;                // continuous columns
+    int col_map[MAX_COL_NUM];    // dimension of a continuous column, -1 for a discrete one
+    int value_num[MAX_COL_NUM];  // values of a discrete column, 1 for a continuous one
+    int dim_col[MAX_DATA_DIM];   // column of each dimension
+};
 
 enum MODE {
     PERFORMANCE,
@@ -38,6 +86,9 @@ struct Operation {
     COL_T col;
 };
 
+// lb <= col <= ub for a continuous column, col == lb for a discrete one.
+// The predicates of a query on different columns are AND-ed, several on the
+// same column are OR-ed: a union of intervals, or an IN-list
 struct Predication {
     COL_T col;
     FLOAT_T lb;
@@ -49,9 +100,29 @@ struct GroupAnswer {
     FLOAT_T value;
 };
 
+// 95% confidence interval of a GroupAnswer, never wider than the range the
+// node counts and bounds allow
+struct AnswerBound {
+    FLOAT_T lo;
+    FLOAT_T hi;
+};
+
+struct QueryStats;
+
+// Why a query got no answers, see Answer::error
+enum QUERY_ERROR {
+    QUERY_OK,
+    BAD_QUERY,  // an op, predicate or GROUP BY on a column the schema does not allow
+    NO_MODEL,   // no built model holds the discrete columns of the query
+};
+
 struct Answer {
     GroupAnswer* group_ans;
     int size;
+    int stopped_early;     // 1 if a progressive query ran out of time first
+    int error;             // QUERY_ERROR
+    AnswerBound* bounds;  // bound of each group_ans, only set by aqpQueryProgressive
+    QueryStats* stats;    // work of the query, only set with AQP_STATS
 };
 
 struct AnswerBatch {
@@ -59,39 +130,324 @@ struct AnswerBatch {
     int size;
 };
 
+class ThreadPool;
+
+// Get the shared pool, or a share of it, running thread_num tasks at once;
+// nullptr to run on the caller. thread_num <= 0 means one thread per core
+ThreadPool* get_pool(int thread_num);
+
+// Parameters of one tree build, shared read-only by the build tasks
+struct BuildContext {
+    COL_T split_axises[MAX_COL_NUM];
+    int split_axis_num;
+    int max_depth;
+    // k larger, performance better
+    // k smaller, accuracy better
+    float build_k;
+    ThreadPool* pool;  // nullptr to build serially
+    bool synopses;     // give every leaf a LeafSynopsis
+};
+
+// Bins of a LeafSynopsis per dimension
+#define SYNOPSIS_BINS 8
+
+// How the rows of a leaf spread over its bound: on dimension i, cdf[i][b] / 255
+// of them lie below lo + (b + 1) / SYNOPSIS_BINS of the bound's width, the
+// distribution being taken as linear inside a bin. A leaf estimated with it
+// needs no uniform spread, so trees can stop splitting sooner
+struct LeafSynopsis {
+    uint8_t cdf[MAX_DATA_DIM][SYNOPSIS_BINS - 1];
+};
+
 struct Node {
     struct Node* lchild;
     struct Node* rchild;
     int count;
-    FLOAT_T sum[DATA_DIM];
+    // doubles: a variance is the small difference of two large sums
+    double sum[MAX_DATA_DIM];
+    double sumsq[MAX_DATA_DIM];  // sum of squares
     BOUND_T bound;
+    LeafSynopsis* synopsis = nullptr;  // of a leaf, when the build keeps synopses
+};
+
+// Pointer-free node used by model files and queries. A tree is one contiguous
+// array in preorder: the left child of an internal node is the next node and
+// the right child is `rchild` nodes further on. Leaves have rchild == 0.
+// Per-dimension fields are padded to LANES. The sums are doubles, see Node
+struct FlatNode {
+    int count;
+    int rchild;
+    double sum[LANES];
+    double sumsq[LANES];
+    FLOAT_T lo[LANES];  // must directly precede hi, see queryRangeAVX512
+    FLOAT_T hi[LANES];
+};
+
+// Node encodings of a model file, chosen per model with setNodeFormat
+enum NODE_FORMAT {
+    FLAT_NODES,            // FlatNode, queried by the SIMD kernels
+    COMPACT_NODES,         // CompactNode with float sums
+    COMPACT_DOUBLE_NODES,  // CompactNode with double sums
+};
+
+// A tree of a compact model: this record, then node_num CompactNodes in the
+// same preorder as FlatNode. A node's bound is quantized to 16 bits per side
+// against the decoded bound of its parent (the root against lo / hi below),
+// rounding outwards, so it always contains the node's rows. The sums are
+// stored apart, data_dim sums then data_dim sums of squares per node, floats
+// or doubles, from sum_offset bytes after this record, so a traversal only
+// touches them for accepted nodes. Float sums trade the precision of VAR and
+// STDDEV for memory
+struct CompactTree {
+    FLOAT_T lo[MAX_DATA_DIM];
+    FLOAT_T hi[MAX_DATA_DIM];
+    uint32_t node_num;
+    uint32_t reserved;
+    int64_t sum_offset;
+};
+
+struct CompactNode {
+    uint32_t count;
+    uint32_t rchild;
+    uint16_t lo[MAX_DATA_DIM];
+    uint16_t hi[MAX_DATA_DIM];
+};
+
+// Root of a tree: a FlatNode or a CompactTree, depending on Model::format
+using TREE_T = const void*;
+
+// Model file layout:
+//   ModelHeader | FlatNode[node_num] | TreeEntry[tree_num]
+// or, for compact models,
+//   ModelHeader | sums | (CompactTree, CompactNode[])[tree_num] | TreeEntry[tree_num]
+// so the whole file can be mmap-ed and queried in place. With leaf_synopses
+// the FlatNodes of a tree are followed by the LeafSynopsis of each of its
+// leaves, in preorder.
+struct ModelHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t node_size;
+    uint32_t tree_num;
+    uint64_t node_num;
+    uint64_t dir_offset;  // byte offset of the TreeEntry directory
+    // build parameters, reused when appended data forces a tree to be rebuilt
+    int32_t delta_depth;
+    float build_k;
+    uint32_t node_format;  // NODE_FORMAT
+    uint32_t data_dim;     // of the schema the model was built with
+    uint32_t leaf_synopses;  // flat trees carry a LeafSynopsis per leaf
+    uint32_t reserved;
+};
+
+struct TreeEntry {
+    int idx;         // mixed-radix index of the discrete values of the group
+    int node_num;
+    int delta;        // rows appended to the tree since it was built
+    uint64_t offset;  // byte offset of the root node, or CompactTree, of the tree
+};
+
+// Dataset file layout, written by kdtree_aqp.saveDatasetFile:
+//   DatasetHeader | ColumnEntry[col_num] | column data and dictionaries
+// A column holds row_num float32 values or row_num int32 dictionary codes.
+// A dictionary is dict_size NUL-terminated UTF-8 strings, the i-th naming code i
+struct DatasetHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t col_num;
+    uint32_t reserved;
+    uint64_t row_num;
+};
+
+enum COLUMN_TYPE : uint32_t {
+    FLOAT_COLUMN,
+    CODE_COLUMN,
+};
+
+struct ColumnEntry {
+    uint32_t type;  // COLUMN_TYPE
+    uint32_t dict_size;
+    uint64_t offset;  // byte offset of the column, aligned to its element size
+    uint64_t dict_offset;
+    uint64_t dict_bytes;
+};
+
+// A model without continuous columns has a single leaf per group. Its cube
+// lays their aggregates out column by column, indexed by root_idx like
+// Model::dense, so a query without ranges adds them up with no traversal.
+// Cells of absent groups have count 0
+struct AggregateCube {
+    std::vector<uint32_t> count;
+    std::vector<double> sum[MAX_DATA_DIM];
+    std::vector<double> sumsq[MAX_DATA_DIM];
+    std::vector<FLOAT_T> min[MAX_DATA_DIM];
+    std::vector<FLOAT_T> max[MAX_DATA_DIM];
+
+    size_t memory() const;
+};
+
+// A mapped model file, shared by the queries using it and unmapped when
+// the last of them releases it
+struct Model {
+    void* addr = nullptr;
+    size_t bytes = 0;
+    NODE_FORMAT format = FLAT_NODES;
+    bool synopses = false;  // see ModelHeader::leaf_synopses
+    // (root_idx, root) of every tree, sorted by root_idx
+    std::vector<std::pair<int, TREE_T>> trees;
+    // root_idx -> root: a dense array for small key spaces,
+    // otherwise an open-addressing table
+    std::vector<TREE_T> dense;
+    std::vector<std::pair<int, TREE_T>> table;
+    uint32_t table_mask = 0;
+    // empty unless the model has no continuous columns and a dense index
+    AggregateCube cube;
+
+    Model() = default;
+    Model(const Model&) = delete;
+    Model& operator=(const Model&) = delete;
+    ~Model();
+
+    // root of the tree with this root_idx, nullptr if the group is empty
+    TREE_T find(int root_idx) const;
+
+    // bytes charged to the model cache: the mapping, the indexes and the cube
+    size_t memory() const;
+};
+
+struct CacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t prefetches;  // models mapped by prefetchModels
+    uint64_t evictions;
+    uint64_t loaded_bytes;
+    uint64_t evicted_bytes;
+    uint64_t resident_bytes;
+    uint64_t memory_limit;
+    int resident_models;
+    int pinned_models;
+};
+
+// Work done by queries with AQP_STATS: by one query in Answer::stats, by all
+// of them since resetQueryStats in getQueryStats
+struct QueryStats {
+    uint64_t queries;
+    uint64_t nodes_visited;    // popped by the traversals
+    uint64_t nodes_contained;  // inner nodes inside the query, added without descending
+    uint64_t partial_leaves;   // leaves crossing the query, scaled by their cross ratio
+    uint64_t groups_probed;    // trees looked up, empty groups included
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t result_hits;  // answered from the result cache, without a model
+    uint64_t load_ns;      // opening the models of the misses
+    uint64_t load_bytes;   // charged to the cache by those models
+    uint64_t query_ns;
+};
+
+// One query shape of a workload, see adviseModels
+struct WorkloadEntry {
+    MODEL_KEY_T pred_cols;  // bitmask of the columns with a predicate
+    COL_T groupBy_col;      // -1 for none
+    double frequency;
+};
+
+// A model picked by adviseModels and the estimates it was picked on
+struct ModelAdvice {
+    MODEL_KEY_T model_key;
+    int delta_depth;
+    uint64_t bytes;      // of the model file
+    double frequency;    // of the workload's queries answered by the model
+    double nodes;        // nodes such a query visits, on average
+    double partial;      // share of the rows it reaches that lie in partly covered leaves, estimated
+};
+
+// What a range traversal gathers over the rows of a tree in the query. count,
+// sum and sumsq add up the accepted nodes scaled by their cross ratio; min and
+// max are those of the nodes' bounds clipped to the query, exact for a node
+// inside it. Without an accepted node min > max
+struct RangeSummary {
+    double count;
+    alignas(32) double sum[LANES];
+    alignas(32) double sumsq[LANES];
+    alignas(32) FLOAT_T min[LANES];
+    alignas(32) FLOAT_T max[LANES];
+#ifdef AQP_STATS
+    // work of the traversals, see QueryStats
+    uint64_t visited;
+    uint64_t contained;
+    uint64_t partial_leaves;
+#endif
+};
+
+// Everything one query needs while it runs, so that queries share no state
+struct QueryContext {
+    COL_T split_axises[MAX_COL_NUM];
+    int split_axis_num = 0;
+    uint32_t split_mask = 0;  // bit i set if dimension i is a split axis
+    alignas(32) FLOAT_T lo[LANES];
+    alignas(32) FLOAT_T hi[LANES];
+    MODEL_KEY_T model_key = 0;
+    int col_values[MAX_COL_NUM];  // value of each discrete column fixed by a predicate, -1 if none
+    // The sorted, disjoint intervals of dimension i are [range_lo[k], range_hi[k]]
+    // for k in [range_begin[i], range_begin[i + 1]), lo / hi above being their
+    // hull. multi_range is set if some dimension has more than one
+    bool multi_range = false;
+    int range_begin[MAX_DATA_DIM + 1];
+    FLOAT_T range_lo[MAX_QUERY_PREDS];
+    FLOAT_T range_hi[MAX_QUERY_PREDS];
+    // The sorted values of discrete column c are values[k] for k in
+    // [value_begin[c], value_begin[c + 1]). With more than one, an IN-list,
+    // col_values holds the combination of values being evaluated
+    int value_begin[MAX_COL_NUM + 1];
+    int values[MAX_QUERY_PREDS];
 };
 
 /* KD tree module */
 
-// Building a tree based on the basic parameters of the KD tree
-extern "C" void build(INT_T* col, int size, int delta_depth, float _build_k);
+// Building a tree based on the basic parameters of the KD tree.
+// thread_num <= 0 uses every core, 1 builds serially.
+extern "C" void build(INT_T* col, int size, int delta_depth, float _build_k, int thread_num);
+
+// Node encoding of the models built from now on, FLAT_NODES by default
+extern "C" void setNodeFormat(NODE_FORMAT format);
+
+// Whether the flat models built from now on keep a LeafSynopsis per leaf,
+// off by default. Compact models never do
+extern "C" void setLeafSynopses(int enabled);
+
+// Build `model_num` models at once, model i has the next sizes[i] columns of cols
+extern "C" void buildModels(INT_T* cols, INT_T* sizes, int model_num, int delta_depth, float _build_k, int thread_num);
+
+// Build the models picked by adviseModels, each with its own delta_depth
+extern "C" void buildAdvisedModels(const ModelAdvice* advice, int advice_num, float _build_k, int thread_num);
+
+// Byte budget of the models buildModels and buildAdvisedModels build at
+// once, BUILD_MEMORY by default. Each is estimated at its peak from the
+// dataset size and its tree depth; one larger than the budget is built alone
+extern "C" void setBuildMemory(uint64_t bytes);
 
 // Calculate the cross ratio for approximate calculations (consider all dimensions)
-double data_cross_ratio(const BOUND_T& bound_in, const BOUND_T& bound_out);
+double data_cross_ratio(const FlatNode& u, const QueryContext& ctx);
 
-// Whether it includes (only considering the KD tree segmentation dimension)
-int kd_contain(const BOUND_T& bound_in, const BOUND_T& bound_out);
+// Whether the query bound includes it (only considering the KD tree segmentation dimension)
+int kd_contain(const FlatNode& u, const QueryContext& ctx);
 
-// Whether to intersect (considering only the KD tree segmentation dimension)
-int kd_cross(const BOUND_T& bound_in, const BOUND_T& bound_out);
+// Whether to intersect the query bound (considering only the KD tree segmentation dimension)
+int kd_cross(const FlatNode& u, const QueryContext& ctx);
 
 // Use the data in the range of [L, R) to establish a KD tree
-Node* buildKDTree(DATA_T* data, int l, int r, int depth);
+Node* buildKDTree(DATA_T* data, int l, int r, int depth, const BuildContext& ctx);
 
-// Write tree to hard disk
-void saveKDTree(Node* u);
+// Append tree to `out` in preorder, return the number of nodes written. The
+// synopses of its leaves go to `synopses` in the same order, if given
+int flattenKDTree(Node* u, std::vector<FlatNode>& out, std::vector<LeafSynopsis>* synopses = nullptr);
 
-// Write a ID before writing a tree
-void saveIDKDTree(Node* u, int id);
+// Write a flattened tree to the model file and record it in the directory
+void saveKDTree(FILE* file, const std::vector<FlatNode>& nodes, int id, std::vector<TreeEntry>& dir);
 
-// Load a tree to memory
-Node* loadKDTree();
+// Add one row to a flattened tree, growing count, sum and bound of every
+// node on the path to the leaf that fits the row best. Return the rank of
+// that leaf among the leaves in preorder
+int insertKDTree(FlatNode* root, const FLOAT_T* row);
 
 // Release tree memory
 void clearKDTree(Node* u);
@@ -101,49 +457,182 @@ void testKDTree(Node* u, int depth);
 // Print tree to the screen
 void printKDTree(Node* u, int depth);
 
-/* Query module */
+/* Index advisor module */
 
-// Get the model name corresponding to the column
-std::string get_model_name(COL_VALUE_T& col_value);
+// Pick the models to build for a workload of entry_num query shapes and the
+// delta_depth of each, within memory_budget bytes of model files. Sizes and
+// costs are estimated from the group sizes of the loaded dataset. Write at
+// most max_advice picks to advice, most frequent first, and return how many
+// were written. Shapes whose model does not fit the budget get none
+extern "C" int adviseModels(const WorkloadEntry* workload,
+                            int entry_num,
+                            MODE mode,
+                            uint64_t memory_budget,
+                            ModelAdvice* advice,
+                            int max_advice);
 
-// Get the model path corresponding to model_name
-std::string get_model_path(std::string model_name);
+/* Query module */
 
-// Get the root node of the KD tree corresponding to the column
-Node* get_root(COL_VALUE_T col_value);
+// Get the model name corresponding to the columns
+std::string get_model_name(MODEL_KEY_T model_key);
 
-// Recursive query
-void _queryRange(Node* u, const BOUND_T& bound, FLOAT_T* sum, double* count);
+// Parse a model name back into its columns, 0 if it is malformed
+MODEL_KEY_T get_model_key(const char* model_name);
 
-// Initialization query and recursive query
-void queryRange(Node* root, BOUND_T& bound, FLOAT_T* sum, double& count);
+// Get the model path corresponding to model_name
+std::string get_model_path(std::string model_name);
 
-// Get the answer to the query
+// Get the model corresponding to the columns, loading it if needed
+std::shared_ptr<const Model> get_model(MODEL_KEY_T model_key, QueryStats* stats = nullptr);
+
+// Mixed-radix index of the discrete column values of a tree in its model
+int get_root_idx(MODEL_KEY_T model_key, const int* col_values);
+
+// Get the root node of the KD tree corresponding to the column values
+TREE_T get_root(const Model& model, MODEL_KEY_T model_key, const int* col_values);
+
+// Collect the (value, root) of every tree of the model whose discrete values
+// match col_values, groupBy_col taking all its values, in value order
+void find_groups(const Model& model,
+                 MODEL_KEY_T model_key,
+                 const int* col_values,
+                 COL_T groupBy_col,
+                 std::vector<std::pair<int, TREE_T>>& groups);
+
+// Range traversal kernels, they add the tree's rows in the query to out.
+// queryRange dispatches to the widest one the CPU supports. The scalar ones
+// are instantiated for the schema's dimension count DIM
+template <int DIM>
+void queryRangeScalar(const FlatNode* root, const QueryContext& ctx, RangeSummary& out);
+void queryRangeAVX2(const FlatNode* root, const QueryContext& ctx, RangeSummary& out);
+void queryRangeAVX512(const FlatNode* root, const QueryContext& ctx, RangeSummary& out);
+
+// Range traversal of a compact tree, SUM_T is float or double as stored
+template <typename SUM_T, int DIM>
+void queryRangeCompact(const CompactTree* tree, const QueryContext& ctx, RangeSummary& out);
+
+// Initialization query and traversal of a tree of the model
+void queryRange(const Model& model, TREE_T root, const QueryContext& ctx, RangeSummary& out);
+
+// Get the answer to the query. Safe to call from many threads at once, the
+// answer belongs to the caller until it is passed to freeAnswer. When the
+// model of its columns was not built, the query is answered from the
+// smallest built model covering its discrete columns, see resolve_model.
+// The group summaries of recent queries are cached, see setResultCacheSize
 extern "C" Answer* aqpQuery(Operation* ops, int, Predication* preds, int, COL_T, MODE);
 
-// Release the memory of the last answer
-void clearans();
+// Byte budget of the result cache, RESULT_CACHE_BYTES by default, 0 turns it
+// off. It holds the summaries of the groups of recent queries by their
+// normalized predicates, so a query repeated with any op list, or a single
+// group of a cached GROUP BY, is answered without touching a model. Building,
+// loading or appending to models clears it
+extern "C" void setResultCacheSize(uint64_t bytes);
+
+// Answer the query progressively: nodes are expanded best-first, the ones
+// holding the most rows that may or may not match first, until every
+// confidence interval is within error_target of its value (relative half
+// width) or
+// time_budget_ms has passed. A limit <= 0 is ignored; with neither, every
+// node aqpQuery uses is reached and the estimate is that of aqpQuery, only
+// clamped into the bounds. Always single-threaded
+extern "C" Answer* aqpQueryProgressive(Operation* ops,
+                                       int ops_size,
+                                       Predication* preds,
+                                       int preds_size,
+                                       COL_T groupBy_col,
+                                       MODE mode,
+                                       double time_budget_ms,
+                                       double error_target);
+
+// Threads used to evaluate the groups of one GROUP BY query, <= 0 uses every core
+extern "C" void setQueryThreads(int thread_num);
+
+// Release the memory of an answer
+extern "C" void freeAnswer(Answer* ans);
+
+// Answer query_num packed queries at once. Query i uses
+// ops[op_offsets[i], op_offsets[i + 1]) and preds[pred_offsets[i], pred_offsets[i + 1]).
+// Queries are grouped by model and run on thread_num threads (<= 0: all cores)
+extern "C" AnswerBatch* aqpQueryBatch(Operation* ops,
+                                      INT_T* op_offsets,
+                                      Predication* preds,
+                                      INT_T* pred_offsets,
+                                      COL_T* groupBy_cols,
+                                      int query_num,
+                                      MODE mode,
+                                      int thread_num);
+
+// Release the memory of a batch of answers
+extern "C" void freeAnswerBatch(AnswerBatch* batch);
+
+// Work of all queries since the last reset, zeros without AQP_STATS
+extern "C" void getQueryStats(QueryStats* stats);
+
+extern "C" void resetQueryStats();
 
 /* Initialization module */
 
+// Read the schema of the model directory, see Schema
 void load_col_type();
 
+// The schema in use
+const Schema& get_schema();
+
+// Use col_num columns, value_num[c] being 0 for a continuous column and the
+// number of values of a discrete one. The schema is saved in the model
+// directory with the models built next. Must not run during queries or builds
+extern "C" void setSchema(int col_num, const INT_T* value_num);
+
 extern "C" void init(const char* dir);
 
 /* Load dataset module */
 
+// Use n row-major rows of col_num floats as the dataset. The buffer is
+// borrowed, not copied: it must stay valid until the dataset is cleared
 extern "C" void loadData(FLOAT_T* _data, int n);
 
+// Map a dataset file (see DatasetHeader) and use its columns in place
+extern "C" void loadDataFile(const char* path);
+
+// Append n rows (same layout as loadData) to the dataset and to every model
+// in model_list.txt. Rows are added to the trees in place; a tree whose
+// appended rows exceed 1 / REBUILD_RATIO of its rows, or a group that had no
+// tree yet, is rebuilt from the dataset. Must not run during a build
+extern "C" void appendData(FLOAT_T* rows, int n, int thread_num);
+
 void clearData();
 
 /* Loading model */
 
-void load_model(const std::string model_name);
+// Map a model file, the model is empty if the file is missing or invalid
+std::shared_ptr<Model> open_model(MODEL_KEY_T model_key);
 
-void clear_model(const std::string model_name);
+// Get a loaded model or load it, safe to call concurrently
+std::shared_ptr<const Model> load_model(MODEL_KEY_T model_key, QueryStats* stats = nullptr);
+
+void clear_model(MODEL_KEY_T model_key);
 
 extern "C" void load_models();
 
+// Map these models on background threads and return at once. A query that
+// needs one of them before it is ready waits for that load instead of
+// mapping the file again
+extern "C" void prefetchModels(MODEL_KEY_T* model_keys, int model_num);
+
+/* Model cache */
+
+// Byte budget of the resident models, evicting now if it is exceeded
+extern "C" void setMemoryLimit(uint64_t bytes);
+
+// Keep a model (named like "1_7_8") resident until it is unpinned
+extern "C" void pinModel(const char* model_name);
+
+extern "C" void unpinModel(const char* model_name);
+
+extern "C" void getCacheStats(CacheStats* stats);
+
+extern "C" void resetCacheStats();
+
 /* Destructive module */
 
 void clear_models();
@@ -0,0 +1,242 @@
+// Queries on a schema unlike the flight one: discrete columns interleaved
+// with the continuous ones, so a column index is not its dimension. Answers
+// that the models give exactly are checked against a scan of the data, and
+// ops or predicates on the wrong columns must be rejected. The model directory
+// is then reloaded by a second process, which must get the schema back from
+// it. Exits non-zero on a failed check.
+//
+//   make test
+#include "libaqp.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A (discrete, 4 values), B (continuous), C (discrete, 3), D (continuous),
+// E (discrete, 5), F (continuous)
+#define TEST_COL_NUM 6
+static int value_num[TEST_COL_NUM] = {4, 0, 3, 0, 5, 0};
+static const int ROW_NUM = 20000;
+
+static std::vector<float> rows;
+static int failures = 0;
+
+// the predicates of a column are ORed, see Predication
+static bool matches(int r, const std::vector<Predication>& preds) {
+    for (int c = 0; c < TEST_COL_NUM; c++) {
+        bool constrained = false, any = false;
+        for (auto& p : preds) {
+            if (p.col == c) {
+                float v = rows[r * TEST_COL_NUM + c];
+                constrained = true;
+                any |= value_num[c] > 0 ? v == p.lb : v >= p.lb && v <= p.ub;
+            }
+        }
+        if (constrained && !any) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// op over the rows matching preds whose groupBy_col is id, as fill_answer reports it
+static double scan(const Operation& op, const std::vector<Predication>& preds, COL_T groupBy_col, int id) {
+    double count = 0, sum = 0, sumsq = 0, lo = 1e9, hi = -1e9;
+    for (int r = 0; r < ROW_NUM; r++) {
+        if (!matches(r, preds) || (groupBy_col != -1 && rows[r * TEST_COL_NUM + groupBy_col] != id)) {
+            continue;
+        }
+        double v = op.col >= 0 ? rows[r * TEST_COL_NUM + op.col] : 0;
+        count++;
+        sum += v;
+        sumsq += v * v;
+        lo = std::min(lo, v);
+        hi = std::max(hi, v);
+    }
+    double var = count > 1 ? std::max(0.0, (sumsq - sum * sum / count) / (count - 1)) : 0;
+    switch (op.op) {
+        case OP::COUNT:
+            return count;
+        case OP::SUM:
+            return sum;
+        case OP::AVG:
+            return count == 0 ? 1 : sum / count;
+        case OP::MIN:
+            return count == 0 ? 0 : lo;
+        case OP::MAX:
+            return count == 0 ? 0 : hi;
+        case OP::VAR:
+            return var;
+        case OP::STDDEV:
+            return std::sqrt(var);
+    }
+    return 0;
+}
+
+static void check(const char* name, bool ok) {
+    if (!ok) {
+        failures++;
+    }
+    printf("%s %s\n", ok ? "ok  " : "FAIL", name);
+}
+
+static bool close_to(double value, double expected) {
+    return std::fabs(value - expected) <= 0.1 + 1e-3 * std::fabs(expected);
+}
+
+// run a query and compare every answer with a scan of the data
+static void check_query(const char* name,
+                        std::vector<Operation> ops,
+                        std::vector<Predication> preds,
+                        COL_T groupBy_col,
+                        MODE mode,
+                        bool progressive = false) {
+    Answer* ans = progressive ? aqpQueryProgressive(ops.data(), ops.size(), preds.data(), preds.size(), groupBy_col,
+                                                    mode, 0, 0)
+                              : aqpQuery(ops.data(), ops.size(), preds.data(), preds.size(), groupBy_col, mode);
+    bool ok = ans->size > 0 && ans->size % ops.size() == 0;
+    for (int i = 0; ok && i < ans->size; i++) {
+        const GroupAnswer& g = ans->group_ans[i];
+        double expected = scan(ops[i % ops.size()], preds, groupBy_col, g.id);
+        if (!close_to(g.value, expected)) {
+            printf("     answer %d of group %d: %g, expected %g\n", i, g.id, g.value, expected);
+            ok = false;
+        }
+    }
+    check(name, ok);
+    freeAnswer(ans);
+}
+
+// an unlimited progressive query must give the answers of aqpQuery, whatever
+// they estimate
+static void check_progressive(const char* name, std::vector<Operation> ops, std::vector<Predication> preds, COL_T groupBy_col) {
+    Answer* ans = aqpQuery(ops.data(), ops.size(), preds.data(), preds.size(), groupBy_col, PERFORMANCE);
+    Answer* prog =
+        aqpQueryProgressive(ops.data(), ops.size(), preds.data(), preds.size(), groupBy_col, PERFORMANCE, 0, 0);
+    bool ok = ans->size > 0 && ans->size == prog->size;
+    for (int i = 0; ok && i < ans->size; i++) {
+        const GroupAnswer &a = ans->group_ans[i], &p = prog->group_ans[i];
+        if (a.id != p.id || std::fabs(a.value - p.value) > 1e-3 * std::max(1.0, std::fabs((double)a.value))) {
+            printf("     answer %d of group %d: %g progressively, %g\n", i, a.id, p.value, a.value);
+            ok = false;
+        }
+    }
+    check(name, ok);
+    freeAnswer(ans);
+    freeAnswer(prog);
+}
+
+static void check_rejected(const char* name,
+                           Operation op,
+                           Predication pred = {0, 1, 1},
+                           COL_T groupBy_col = -1,
+                           int error = BAD_QUERY) {
+    Answer* ans = aqpQuery(&op, 1, &pred, 1, groupBy_col, PERFORMANCE);
+    check(name, ans->size == 0 && ans->error == error);
+    freeAnswer(ans);
+}
+
+static void build(std::vector<std::vector<int>> models, int delta_depth, int thread_num = 1) {
+    std::vector<int> cols, sizes;
+    for (auto& model : models) {
+        cols.insert(cols.end(), model.begin(), model.end());
+        sizes.push_back(model.size());
+    }
+    buildModels(cols.data(), sizes.data(), models.size(), delta_depth, 1, thread_num);
+    load_models();
+}
+
+static std::vector<Operation> ops = {{OP::COUNT, -1}, {OP::SUM, 3}, {OP::AVG, 5}, {OP::MIN, 1},
+                                     {OP::MAX, 5},    {OP::VAR, 3}, {OP::STDDEV, 1}};
+// whole-range predicates keep the tree answers exact
+static Predication all_b = {1, -1e6, 1e6}, all_d = {3, -1e6, 1e6}, all_f = {5, -1e6, 1e6};
+
+// the same rows in every process
+static void make_rows() {
+    std::mt19937 rng(1);
+    rows.resize(ROW_NUM * TEST_COL_NUM);
+    for (int r = 0; r < ROW_NUM; r++) {
+        for (int c = 0; c < TEST_COL_NUM; c++) {
+            // continuous columns of different ranges, so a mixed-up dimension shows
+            rows[r * TEST_COL_NUM + c] = value_num[c] > 0 ? rng() % value_num[c] : (rng() % 10000) * (c + 1) / 100.0f;
+        }
+    }
+}
+
+// the second process: only the models and schema.txt are on disk
+static int reload(const char* dir) {
+    make_rows();
+    init(dir);
+    load_models();
+    check("reload, schema", get_schema().col_num == TEST_COL_NUM && get_schema().col_map[2] == -1 && get_schema().value_num[4] == 5);
+    check_query("reload, memory, continuous predicates", ops, {all_d, {4, 2, 2}}, -1, MEMORY);
+    check_query("reload, memory, discrete predicates, group by", ops, {{0, 1, 1}, {2, 2, 2}}, 4, MEMORY);
+    check_rejected("reload, op on a discrete column", {OP::SUM, 2});
+    return failures;
+}
+
+int main(int argc, char** argv) {
+    if (argc == 3 && std::string(argv[1]) == "--reload") {
+        return reload(argv[2]) == 0 ? 0 : 1;
+    }
+    char dir[] = "/tmp/aqp_test_schemaXXXXXX";
+    if (mkdtemp(dir) == nullptr) {
+        printf("FAIL cannot create a model directory\n");
+        return 1;
+    }
+    // the schema is set before the directory has models, build saves it again
+    std::string models = std::string(dir) + "/models";
+    init(models.c_str());
+    setSchema(TEST_COL_NUM, value_num);
+    mkdir(models.c_str(), 0755);
+    make_rows();
+    loadData(rows.data(), ROW_NUM);
+    setResultCacheSize(0);
+
+    build({{0, 2}, {4}, {1, 0}, {3, 5, 2}}, -2);
+    check_query("performance, discrete predicates, cube", ops, {{0, 2, 2}, {2, 1, 1}}, -1, PERFORMANCE);
+    check_query("performance, discrete IN-list, group by", ops, {{0, 1, 1}, {0, 3, 3}}, 2, PERFORMANCE);
+    check_query("performance, group by only", ops, {}, 4, PERFORMANCE);
+    check_query("performance, continuous predicate", ops, {all_b, {0, 3, 3}}, -1, PERFORMANCE);
+    check_query("performance, continuous predicates, group by", ops, {all_f, all_d, {2, 0, 0}}, 2, PERFORMANCE);
+    check_query("performance, covering model", ops, {all_d, all_f}, -1, PERFORMANCE);
+    check_query("progressive", ops, {all_b, {0, 0, 0}}, -1, PERFORMANCE, true);
+    check_query("performance, every continuous column", ops, {all_b, all_d, all_f}, -1, PERFORMANCE);
+    check_rejected("performance, no model holds the discrete columns", {OP::COUNT, -1}, {0, 1, 1}, 4, NO_MODEL);
+
+    // on every core, but a budget below any model builds them one at a time
+    setBuildMemory(1);
+    build({{1, 3, 5}, {1, 3, 5, 0}, {1, 3, 5, 4}, {0, 2, 4}}, 1, 0);
+    check_query("memory, continuous predicates", ops, {all_d, {4, 2, 2}}, -1, MEMORY);
+    check_query("memory, discrete predicates", ops, {{0, 1, 1}}, -1, MEMORY);
+    check_query("memory, discrete predicates, group by", ops, {{0, 1, 1}, {2, 2, 2}}, 4, MEMORY);
+
+    // partial ranges, so the leaves are estimated from their synopses
+    setLeafSynopses(1);
+    build({{1, 5, 0}}, 0);
+    setLeafSynopses(0);
+    std::vector<Operation> sums = {{OP::COUNT, -1}, {OP::SUM, 5}, {OP::AVG, 1}};
+    check_progressive("progressive, leaf synopses", sums, {{1, 10, 40}, {5, 100, 350}, {0, 2, 2}}, -1);
+    check_progressive("progressive, leaf synopses, group by", sums, {{1, 10, 40}, {5, 100, 350}}, 0);
+
+    check_rejected("op on a discrete column", {OP::SUM, 2});
+    check_rejected("op on no column", {OP::AVG, -1});
+    check_rejected("op past the last column", {OP::MAX, TEST_COL_NUM});
+    check_rejected("predicate past the last column", {OP::COUNT, -1}, {TEST_COL_NUM, 0, 1});
+    check_rejected("predicate on a value a discrete column lacks", {OP::COUNT, -1}, {0, 4, 4});
+    check_rejected("predicate on a fractional discrete value", {OP::COUNT, -1}, {2, 0.5, 0.5});
+    check_rejected("group by a continuous column", {OP::COUNT, -1}, {0, 1, 1}, 3);
+    check_rejected("group by past the last column", {OP::COUNT, -1}, {0, 1, 1}, TEST_COL_NUM);
+
+    fflush(stdout);
+    check("reload", system((std::string(argv[0]) + " --reload " + models).c_str()) == 0);
+
+    system((std::string("rm -rf ") + dir).c_str());
+    printf("%d failed\n", failures);
+    return failures == 0 ? 0 : 1;
+}
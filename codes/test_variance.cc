@@ -0,0 +1,88 @@
+// VAR and STDDEV of values with a large mean and a small spread, where a
+// sum of squares kept in floats cancels to noise. The answers of the tree,
+// cube and progressive paths are checked against a two-pass scan. Exits
+// non-zero on a failed check.
+//
+//   make test
+#include "libaqp.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+// A (discrete, 2 values), B (continuous, 1e4 + U(0, 1))
+#define TEST_COL_NUM 2
+static int value_num[TEST_COL_NUM] = {2, 0};
+static const int ROW_NUM = 1 << 20;
+
+static std::vector<float> rows;
+static int failures = 0;
+
+// sample variance of B over the rows whose A is a, any A for -1
+static double two_pass_var(int a) {
+    double n = 0, sum = 0;
+    for (int r = 0; r < ROW_NUM; r++) {
+        if (a == -1 || rows[r * TEST_COL_NUM] == a) {
+            n++;
+            sum += rows[r * TEST_COL_NUM + 1];
+        }
+    }
+    double mean = sum / n, m2 = 0;
+    for (int r = 0; r < ROW_NUM; r++) {
+        if (a == -1 || rows[r * TEST_COL_NUM] == a) {
+            double d = rows[r * TEST_COL_NUM + 1] - mean;
+            m2 += d * d;
+        }
+    }
+    return m2 / (n - 1);
+}
+
+static void check_var(const char* name, std::vector<Predication> preds, int a, bool progressive = false) {
+    Operation ops[2] = {{OP::VAR, 1}, {OP::STDDEV, 1}};
+    Answer* ans = progressive ? aqpQueryProgressive(ops, 2, preds.data(), preds.size(), -1, PERFORMANCE, 0, 0)
+                              : aqpQuery(ops, 2, preds.data(), preds.size(), -1, PERFORMANCE);
+    double expected = two_pass_var(a);
+    bool ok = ans->size == 2 && std::fabs(ans->group_ans[0].value - expected) <= 1e-4 * expected &&
+              std::fabs(ans->group_ans[1].value - std::sqrt(expected)) <= 1e-4 * std::sqrt(expected);
+    if (ans->size == 2) {
+        printf("     var %.9g, stddev %.9g, expected %.9g\n", ans->group_ans[0].value, ans->group_ans[1].value,
+               expected);
+    }
+    printf("%s %s\n", ok ? "ok  " : "FAIL", name);
+    failures += !ok;
+    freeAnswer(ans);
+}
+
+int main() {
+    char dir[] = "/tmp/aqp_test_varianceXXXXXX";
+    if (mkdtemp(dir) == nullptr) {
+        printf("FAIL cannot create a model directory\n");
+        return 1;
+    }
+    init(dir);
+    setSchema(TEST_COL_NUM, value_num);
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> spread(0, 1);
+    rows.resize(ROW_NUM * TEST_COL_NUM);
+    for (int r = 0; r < ROW_NUM; r++) {
+        rows[r * TEST_COL_NUM] = rng() % 2;
+        rows[r * TEST_COL_NUM + 1] = 1e4f + spread(rng);
+    }
+    loadData(rows.data(), ROW_NUM);
+    setResultCacheSize(0);
+
+    int cols[] = {1, 0}, sizes[] = {1, 1};
+    buildModels(cols, sizes, 2, 0, 1, 0);
+    load_models();
+    check_var("tree", {{1, -1e6, 1e6}}, -1);
+    check_var("progressive", {{1, -1e6, 1e6}}, -1, true);
+    check_var("cube", {{0, 1, 1}}, 1);
+
+    system((std::string("rm -rf ") + dir).c_str());
+    printf("%d failed\n", failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,221 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool. Every worker owns a deque: it pushes and pops its
+// own tasks at the back and steals from the front of the other deques. Tasks
+// submitted from outside the pool are spread round-robin.
+//
+// A share of a pool has no workers of its own: its tasks run on the pool's,
+// at most width of them at once, the rest waiting in the share until one of
+// its running tasks finishes.
+class ThreadPool {
+   public:
+    using Task = std::function<void()>;
+
+    explicit ThreadPool(int thread_num) : queues(thread_num), stop(false), queued(0), next(0) {
+        for (int i = 0; i < thread_num; i++) {
+            queues[i].reset(new Queue);
+        }
+        for (int i = 0; i < thread_num; i++) {
+            workers.emplace_back([this, i]() { worker_loop(i); });
+        }
+    }
+
+    ThreadPool(ThreadPool* base, int width) : stop(false), queued(0), next(0), base(base), width(width), running(0) {}
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> guard(sleep_lock);
+            stop = true;
+        }
+        sleep_cv.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    int size() const { return base != nullptr ? width : workers.size(); }
+
+    void submit(Task task) {
+        if (base != nullptr) {
+            {
+                std::lock_guard<std::mutex> guard(share_lock);
+                if (running >= width) {
+                    waiting.push_back(std::move(task));
+                    return;
+                }
+                running++;
+            }
+            base->submit([this, task = std::move(task)]() mutable {
+                task();
+                // run the waiting tasks in the slot of the finished one
+                while (true) {
+                    {
+                        std::lock_guard<std::mutex> guard(share_lock);
+                        if (waiting.empty()) {
+                            running--;
+                            return;
+                        }
+                        task = std::move(waiting.front());
+                        waiting.pop_front();
+                    }
+                    task();
+                }
+            });
+            return;
+        }
+        int id = current_pool == this ? current_id : next.fetch_add(1) % queues.size();
+        {
+            std::lock_guard<std::mutex> guard(queues[id]->lock);
+            queues[id]->tasks.push_back(std::move(task));
+        }
+        queued.fetch_add(1);
+        {
+            std::lock_guard<std::mutex> guard(sleep_lock);
+        }
+        sleep_cv.notify_one();
+    }
+
+   private:
+    struct Queue {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    bool pop(int id, Task& task) {
+        if (queued.load() == 0) {
+            return false;
+        }
+        int n = queues.size();
+        for (int k = 0; k < n; k++) {
+            Queue& q = *queues[(id + k) % n];
+            std::lock_guard<std::mutex> guard(q.lock);
+            if (q.tasks.empty()) {
+                continue;
+            }
+            if (k == 0) {
+                task = std::move(q.tasks.back());
+                q.tasks.pop_back();
+            } else {
+                task = std::move(q.tasks.front());
+                q.tasks.pop_front();
+            }
+            queued.fetch_sub(1);
+            return true;
+        }
+        return false;
+    }
+
+    void worker_loop(int id) {
+        current_pool = this;
+        current_id = id;
+        Task task;
+        while (true) {
+            if (pop(id, task)) {
+                task();
+                task = nullptr;
+                continue;
+            }
+            std::unique_lock<std::mutex> guard(sleep_lock);
+            sleep_cv.wait(guard, [this]() { return stop || queued.load() > 0; });
+            if (stop && queued.load() == 0) {
+                return;
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::mutex sleep_lock;
+    std::condition_variable sleep_cv;
+    bool stop;
+    std::atomic<int> queued;
+    std::atomic<unsigned> next;
+
+    // a share's
+    ThreadPool* base = nullptr;
+    int width = 0;
+    std::mutex share_lock;
+    std::deque<Task> waiting;
+    int running = 0;
+
+    static thread_local ThreadPool* current_pool;
+    static thread_local int current_id;
+};
+
+inline thread_local ThreadPool* ThreadPool::current_pool = nullptr;
+inline thread_local int ThreadPool::current_id = 0;
+
+// A set of tasks that can be waited for. The tasks wait in the group, the
+// pool only gets a ticket per task that runs whichever of them is still
+// waiting. wait() runs the waiting ones on the calling thread, so nested
+// groups never starve the pool, and then sleeps until the ones started
+// elsewhere finish; it never picks up a task of another group. Without a pool
+// the tasks simply run inline.
+class TaskGroup {
+   public:
+    explicit TaskGroup(ThreadPool* pool) : pool(pool), state(std::make_shared<State>()) {}
+
+    ~TaskGroup() { wait(); }
+
+    void run(std::function<void()> task) {
+        if (pool == nullptr) {
+            task();
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> guard(state->lock);
+            state->tasks.push_back(std::move(task));
+            state->pending++;
+        }
+        // a ticket may outlive the group when wait() ran its task
+        pool->submit([state = state]() { run_next(*state); });
+    }
+
+    void wait() {
+        if (pool == nullptr) {
+            return;
+        }
+        while (run_next(*state)) {
+        }
+        std::unique_lock<std::mutex> guard(state->lock);
+        state->finished.wait(guard, [this]() { return state->pending == 0; });
+    }
+
+   private:
+    struct State {
+        std::mutex lock;
+        std::condition_variable finished;
+        std::deque<std::function<void()>> tasks;
+        int pending = 0;  // waiting or running
+    };
+
+    // run a waiting task, false if there is none
+    static bool run_next(State& state) {
+        std::function<void()> task;
+        {
+            std::lock_guard<std::mutex> guard(state.lock);
+            if (state.tasks.empty()) {
+                return false;
+            }
+            task = std::move(state.tasks.front());
+            state.tasks.pop_front();
+        }
+        task();
+        std::lock_guard<std::mutex> guard(state.lock);
+        if (--state.pending == 0) {
+            state.finished.notify_all();
+        }
+        return true;
+    }
+
+    ThreadPool* pool;
+    std::shared_ptr<State> state;
+};